@@ -0,0 +1,102 @@
+#!/bin/sh
+# Compare the search throughput of checker builds on the games in corpus/.
+#
+#   ./bench.sh REPEAT RUNS REPORT CHECKER...
+#
+# A pass is one checker -multi 0 1 process playing every corpus game on one
+# thread, which prints one line per move, so the time goes to the search.
+# A run times REPEAT passes of each build in turn, so that a busy machine
+# slows every build alike, and the median of RUNS runs is kept per build.
+# Process startup is timed the same way on an empty game, reported on its
+# own and taken off the pass time before nodes per second and speedup
+# (relative to the first build given) are worked out. All builds search the
+# same nodes, counted once with -s. The report is written to REPORT.
+
+if [ $# -lt 4 ]; then
+  echo "usage: $0 REPEAT RUNS REPORT CHECKER..." >&2
+  exit 1
+fi
+repeat=$1
+runs=$2
+report=$3
+shift 3
+
+corpus=$(dirname "$0")/corpus
+games=$(ls "$corpus"/*.txt | wc -l)
+
+# time_ns COMMAND...: wall time of COMMAND in ns, nothing if it failed
+time_ns() {
+  start=$(date +%s%N)
+  "$@" || return 1
+  end=$(date +%s%N)
+  echo $((end - start))
+}
+
+# median KEY: median of the times recorded for KEY, nothing if a run failed
+median() {
+  awk -v key="$1" -v runs="$runs" '$1 == key { print $2 }' "$times" |
+    sort -n | awk -v runs="$runs" \
+      '{ t[NR] = $1 } END { if (NR == runs) print t[int((NR + 1) / 2)] }'
+}
+
+# passes CHECKER [GAME...]: play the games REPEAT times, all at once
+passes() {
+  checker=$1
+  shift
+  i=0
+  while [ $i -lt "$repeat" ]; do
+    "$checker" -multi 0 1 "$@" > /dev/null || return 1
+    i=$((i + 1))
+  done
+}
+
+nodes=0
+for game in "$corpus"/*.txt; do
+  n=$("$1" -s < "$game" 2>&1 >/dev/null |
+    awk '/^SEARCH:/ { sum += $2 } END { print sum + 0 }')
+  nodes=$((nodes + n))
+done
+
+{
+  echo "CORPUS: $games games, $nodes nodes, $repeat passes, median of $runs runs"
+  printf "%-24s %12s %10s %12s %12s %8s\n" \
+    BUILD STARTUP-MS MS/PASS SEARCH-MS NODES/S SPEEDUP
+} > "$report" || exit 1
+
+times=$(mktemp) || exit 1
+trap 'rm -f "$times"' EXIT
+
+r=0
+while [ $r -lt "$runs" ]; do
+  b=0
+  for checker in "$@"; do
+    t=$(time_ns passes "$checker" "$corpus"/*.txt) && echo "pass$b $t"
+    t=$(time_ns passes "$checker" /dev/null) && echo "start$b $t"
+    b=$((b + 1))
+  done >> "$times"
+  r=$((r + 1))
+done
+
+base=""
+b=0
+for checker in "$@"; do
+  total=$(median pass$b)
+  startup=$(median start$b)
+  b=$((b + 1))
+  if [ -z "$total" ] || [ -z "$startup" ]; then
+    echo "$0: $checker failed" >&2
+    exit 1
+  fi
+
+  pass=$((total / repeat))
+  launch=$((startup / repeat))
+  search=$((pass - launch))
+  [ $search -lt 1 ] && search=1
+  [ -z "$base" ] && base=$search
+
+  awk -v b="$checker" -v launch="$launch" -v pass="$pass" \
+    -v search="$search" -v n="$nodes" -v base="$base" \
+    'BEGIN { printf "%-24s %12.3f %10.2f %12.2f %12.0f %7.2fx\n",
+             b, launch / 1e6, pass / 1e6, search / 1e6, n * 1e9 / search,
+             base / search }' >> "$report" || exit 1
+done
@@ -38,11 +38,22 @@
 
 */
 
+#define _POSIX_C_SOURCE 200809L  // mmap, poll, clock_gettime and pthreads
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <limits.h>
 #include <assert.h>
 #include <string.h>
+#include <time.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <poll.h>
+#include <pthread.h>
+#include <ctype.h>
 
 /*-------------------------------- DEFINES -----------------------------------*/
 #define BOARD_SIZE           8      // board size
@@ -70,6 +81,27 @@
 #define WEST                -1      // goint to the west notation
 
 #define MAX_LEN              6      // max-string of each move          
+
+#define SEARCH_QUANTUM     256      // nodes expanded between yield points
+#define SEARCH_RUNNING       0      // search yielded, can be resumed
+#define SEARCH_DONE          1      // search finished, result is ready
+#define SEARCH_CANCELLED     2      // search stopped by search_cancel
+#define SEARCH_EXPIRED       3      // search stopped by its deadline
+#define KILLER_SLOTS         2      // killer moves remembered per ply
+#define KILLER_SCORE   (1<<30)      // order score of the first killer move
+
+#define DB_MAGIC    0x44474b43      // "CKGD", start of a game database
+#define IDX_MAGIC   0x58494b43      // "CKIX", start of a position index
+#define DB_VERSION           1      // on-disk format version
+#define DB_MAX_MOVES     65535      // moves a game record can hold
+#define DB_TRUNCATED         1      // game flag, record stops at a bad move
+#define MAX_TOKEN           32      // longest log token we look at
+#define INDEX_CHUNK    (1<<20)      // index entries sorted in memory at once
+#define DIRECTORY_COPY    4096      // bucket starts copied into DB.idx at once
+#define MAX_LINE           128      // longest board line we read
+#define INPUT_BUF_SIZE    4096      // session input read ahead
+#define FNV_OFFSET 14695981039346656037ULL // 64-bit FNV-1a board hash
+#define FNV_PRIME  1099511628211ULL
 /*----------------------------------------------------------------------------*/
 
 /*----------------------------- DECLARATIONS ---------------------------------*/
@@ -80,6 +112,92 @@ struct Node { // struct for linked list node
   struct Node* next;
 };
 
+struct Frame { // one level of the explicit minimax stack
+  board_t position;
+  char legal_moves[BOARD_SIZE * BOARD_SIZE][MAX_LEN];
+  char best_move[MAX_LEN];
+  int depth, black, move_count, next, eval;
+  int alpha, beta; // window passed down from the parent
+};
+
+struct DbHeader { // start of a game database file
+  uint32_t magic, version;
+  uint64_t game_count;
+};
+
+struct GameHeader { // start of each game, followed by one byte per move
+  uint32_t game_id;
+  uint16_t move_count;
+  uint8_t result; // game_end of the last position
+  uint8_t flags;
+};
+
+struct IndexHeader { // start of a position index, then entries, directory
+  uint32_t magic, version;
+  uint64_t entry_count;
+  uint64_t db_size;     // size of the DB the index was built from
+  uint32_t bucket_bits; // directory is keyed by the top bits of the hash
+  uint32_t unused;
+};
+
+struct IndexEntry { // one position reached by one game
+  uint64_t hash, offset;
+};
+
+struct Run { // one sorted chunk of index entries in the spill file
+  uint64_t next, end;     // entries of the run still in the file
+  struct IndexEntry* buf; // entries read ahead
+  int len, pos;
+};
+
+struct GameRecord { // game being imported
+  board_t board;
+  int action, move_count, flags;
+  unsigned char moves[DB_MAX_MOVES];
+};
+
+struct SearchStats { // how well move ordering is doing
+  long nodes;         // positions visited
+  long cutoffs;       // alpha-beta cutoffs
+  long first_cutoffs; // cutoffs caused by the first move tried
+};
+
+struct Search { // resumable minimax search
+  struct Frame stack[TREE_DEPTH+1];
+  int top, status, cancelled, result;
+  char best[MAX_LEN];
+  struct SearchStats stats;
+  long long deadline; // stop once now_ns() passes this, 0 for no deadline
+  int killers[TREE_DEPTH+1][KILLER_SLOTS]; // per ply, from*64+to or -1
+  int history[BOARD_SIZE * BOARD_SIZE][BOARD_SIZE * BOARD_SIZE];
+};
+
+struct Worker { // a thread of run_searches and its share of the searches
+  pthread_t thread;
+  struct Search* searches;
+  int count, node_budget, started;
+};
+
+struct Game { // one game of the multi-game driver
+  const char* name;
+  board_t board;
+  int action, pending; // engine actions still to play, from A or P
+};
+
+struct Ponder { // searches run while the opponent is thinking
+  struct Search searches[BOARD_SIZE * BOARD_SIZE];
+  char replies[BOARD_SIZE * BOARD_SIZE][MAX_LEN]; // reply each search is for
+  int count;  // replies being searched, 0 when not pondering
+  int action; // action the searches will play
+  int chosen; // search kept after the reply arrived, -1 until then
+  long ahead; // nodes the kept search had done when it was taken
+};
+
+struct Input { // session input, read as it arrives
+  char buf[INPUT_BUF_SIZE];
+  int len, eof;
+};
+
 int board_cost(board_t board);
 int check_error(char moves_array[], board_t board, int action);
 int eror_six(board_t board, int src_col, int src_row, int tgt_col, int tgt_row);
@@ -93,12 +211,67 @@ void initialise_board(board_t board);
 void print_board(board_t board);
 void print_error(int error);
 void print_moves(board_t board, char moves_array[], int action);
-void stage_moves(board_t board, char moves_array[]);
+void print_search_stats(struct SearchStats* stats);
+
+int compare_entries(const void* a, const void* b);
+int encode_move(const char move[]);
+int is_move(const char token[]);
+int read_board(FILE* in, board_t board);
+int replay_until(const unsigned char* game, board_t target);
+uint64_t board_hash(board_t board);
+void build_index(const char* db_name, uint64_t positions);
+void heap_down(int heap[], int count, struct Run runs[], int i);
+int merge_runs(FILE* spill, struct Run runs[], int run_count, FILE* out, 
+    int bits, uint64_t* kept);
+void refill_run(FILE* spill, struct Run* run, int size);
+struct Run* spill_run(FILE* spill, struct IndexEntry chunk[], int count, 
+    struct Run runs[], int* run_count);
+void decode_move(unsigned char code, char move[]);
+void import_games(const char* db_name, int file_count, char* files[]);
+void query_games(const char* db_name);
+void read_log(FILE* in, FILE* db, struct GameRecord* game, 
+    struct DbHeader* header, uint64_t* positions);
+void record_move(struct GameRecord* game, const char move[]);
+void write_game(FILE* db, struct GameRecord* game, struct DbHeader* header, 
+    uint64_t* positions);
+void* map_file(const char* name, size_t* size);
+void stage_moves(board_t board, char moves_array[], int show_stats);
+void play_action(board_t board, char moves_array[], int* action, 
+    int show_stats, struct Ponder* ponder);
+void engine_move(board_t board, int action, int show_stats, 
+    struct Ponder* ponder);
+
+int next_token(struct Input* input, struct Ponder* ponder, char token[]);
+struct Search* ponder_take(struct Ponder* ponder, board_t board, int action);
+void ponder_reply(struct Ponder* ponder, const char move[]);
+void ponder_start(struct Ponder* ponder, board_t board, int action);
+void ponder_stop(struct Ponder* ponder);
+void session_moves(board_t board, int show_stats);
+
+void game_move(struct Game* game, struct Search* search);
+void load_game(struct Game* game, const char* name);
+void multi_games(double deadline_ms, int threads, int game_count, 
+    char* files[]);
 void update_board(char moves_array[], board_t board, int action);
 
 int find_move(board_t board, int action, 
     char legal_move[BOARD_SIZE * BOARD_SIZE][MAX_LEN]);
-int minimax(board_t position, int depth, int maxi_player, char best[]);
+int minimax(board_t position, int depth, int maxi_player, char best[MAX_LEN],
+    struct SearchStats* stats);
+int move_key(const char move[]);
+int run_searches(struct Search searches[], int count, int node_budget, 
+    int threads);
+void* search_worker(void* arg);
+int search_round(struct Search searches[], int count, int node_budget);
+int search_step(struct Search* search, int node_budget);
+long long now_ns(void);
+void search_cancel(struct Search* search);
+void search_set_deadline(struct Search* search, double deadline_ms);
+void order_moves(struct Search* search, struct Frame* frame, int ply);
+void search_init(struct Search* search, board_t position, int depth, 
+    int maxi_player);
+void search_expire(struct Search* search);
+void search_return(struct Search* search, int eval);
 
 int diff(int num1, int num2);
 int even(int num);
@@ -118,9 +291,37 @@ int
 main(int argc, char *argv[]) {
   board_t board;
   char moves_array[MAX_LEN]; // (5+1) num of character per input string
+  int show_stats = 0, session = 0, i;
+
+  /* game database; checker -import DB [LOG...] or checker -query DB */
+  if (argc > 2 && strcmp(argv[1], "-import") == 0) {
+    import_games(argv[2], argc-3, argv+3);
+    return EXIT_SUCCESS;
+  } else if (argc > 2 && strcmp(argv[1], "-query") == 0) {
+    query_games(argv[2]);
+    return EXIT_SUCCESS;
+  }
+
+  /* several games at once; checker -multi MS THREADS GAME... */
+  if (argc > 4 && strcmp(argv[1], "-multi") == 0) {
+    multi_games(atof(argv[2]), atoi(argv[3]), argc-4, argv+4);
+    return EXIT_SUCCESS;
+  }
+
+  for (i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-s") == 0) {
+      show_stats = 1; // search stats to stderr
+    } else if (strcmp(argv[i], "-p") == 0) {
+      session = 1; // play moves as they arrive and ponder
+    }
+  }
 
   initialise_board(board);
-  stage_moves(board, moves_array); // STAGE O, 1, 2
+  if (session) {
+    session_moves(board, show_stats);
+  } else {
+    stage_moves(board, moves_array, show_stats); // STAGE O, 1, 2
+  }
 
   return EXIT_SUCCESS;  // exit program with the success code
 }
@@ -238,7 +439,7 @@ print_board(board_t board) {
 }
 
 void 
-stage_moves(board_t board, char moves_array[]) {
+stage_moves(board_t board, char moves_array[], int show_stats) {
   /* execute the moves given by the input */
 
   int action = 1;
@@ -258,73 +459,92 @@ stage_moves(board_t board, char moves_array[]) {
 
   struct Node* current_move = move_list; 
   while (current_move != NULL) {
-    /* STAGE 0 */
-    if (strlen(current_move->move) == 5) {
-      print_moves(board, current_move->move, action);
-      action++;
-    }
+    play_action(board, current_move->move, &action, show_stats, NULL);
+    current_move = current_move->next;
+  }
 
-    /* STAGE 1 */
-    else if (*(current_move->move) == 'A') {
-      char best_move[MAX_LEN];
+  free(current_move);
+  delete_list(&move_list); 
+}
 
-      minimax(board, TREE_DEPTH, action, best_move);
-      update_board(best_move, board, action);
-      line_break();
+void
+play_action(board_t board, char moves_array[], int* action, int show_stats, 
+struct Ponder* ponder) {
+  /* play one input string; a move, A or P */
+
+  /* STAGE 0 */
+  if (strlen(moves_array) == 5) {
+    print_moves(board, moves_array, *action);
+    (*action)++;
+  }
 
-      new_action_marker();
-      action_detail(action, best_move);
-      printf("BOARD COST: %d\n", board_cost(board));
-      print_board(board);
+  /* STAGE 1 */
+  else if (*moves_array == 'A') {
+    engine_move(board, *action, show_stats, ponder);
+    (*action)++;
+  }
 
-      action++;
-    }
+  /* STAGE 2 */
+  else if (*moves_array == 'P') {
+    for (int i=0; i<COMP_ACTIONS; i++) {
+      engine_move(board, *action, show_stats, ponder);
 
-    /* STAGE 2 */
-    else if (*(current_move->move) == 'P') {
-      for (int i=0; i<COMP_ACTIONS; i++) {
-        char best_move[MAX_LEN];
+      /* check if game has end */ 
+      int game_status = game_end(board);
+      if (game_status == 1) { 
+        printf("BLACK WIN!"); 
+        exit(EXIT_SUCCESS); 
 
-        minimax(board, TREE_DEPTH, action, best_move);
-        update_board(best_move, board, action);
-        line_break();
+      } else if (game_status == 2) {
+        printf("WHITE WIN!"); 
+        exit(EXIT_SUCCESS);
+      }
 
-        new_action_marker();
-        action_detail(action, best_move);
-        printf("BOARD COST: %d\n", board_cost(board));
-        print_board(board);
+      (*action)++;
+    }
+  }
 
-        /* check if game has end */ 
-        int game_status = game_end(board);
-        if (game_status == 1) { 
-          printf("BLACK WIN!"); 
-          exit(EXIT_SUCCESS); 
+  /* check if game has end */ 
+  int game_status = game_end(board);
+  if (game_status == 1) { 
+    printf("BLACK WIN!\n"); 
+    exit(EXIT_SUCCESS); 
+  }      
+  else if (game_status == 2) {
+    printf("WHITE WIN!\n"); 
+    exit(EXIT_SUCCESS);
+  }
+}
 
-        } else if (game_status == 2) {
-          printf("WHITE WIN!"); 
-          exit(EXIT_SUCCESS);
-        }
+void
+engine_move(board_t board, int action, int show_stats, struct Ponder* ponder) {
+  /* computer plays the action, using a pondered search when one matches */
 
-        action++;
-      }
-    }
+  char best_move[MAX_LEN];
+  struct SearchStats stats;
+  struct Search* search = ponder_take(ponder, board, action);
 
-    /* check if game has end */ 
-    int game_status = game_end(board);
-    if (game_status == 1) { 
-      printf("BLACK WIN!\n"); 
-      exit(EXIT_SUCCESS); 
-    }      
-    else if (game_status == 2) {
-      printf("WHITE WIN!\n"); 
-      exit(EXIT_SUCCESS);
-    }
-    
-    current_move = current_move->next;
+  if (search != NULL) {
+    while (search_step(search, SEARCH_QUANTUM) == SEARCH_RUNNING);
+    strcpy(best_move, search->best);
+    stats = search->stats;
+  } else {
+    minimax(board, TREE_DEPTH, action, best_move, &stats);
   }
+  update_board(best_move, board, action);
+  line_break();
 
-  free(current_move);
-  delete_list(&move_list); 
+  new_action_marker();
+  action_detail(action, best_move);
+  printf("BOARD COST: %d\n", board_cost(board));
+  print_board(board);
+  if (show_stats) {
+    if (search != NULL && ponder->ahead > 0) {
+      fprintf(stderr, "PONDER: %ld nodes searched on the opponent's time\n",
+        ponder->ahead);
+    }
+    print_search_stats(&stats);
+  }
 }
 
 void
@@ -343,6 +563,18 @@ print_moves(board_t board, char moves_array[], int action) {
   }
 }
 
+void
+print_search_stats(struct SearchStats* stats) {
+  /* report search effort on stderr, so the game output stays the same */
+
+  double first = 0;
+  if (stats->cutoffs > 0) {
+    first = 100.0 * stats->first_cutoffs / stats->cutoffs;
+  }
+  fprintf(stderr, "SEARCH: %ld nodes, %ld cutoffs, %.1f%% on first move\n", 
+    stats->nodes, stats->cutoffs, first);
+}
+
 void
 action_detail(int action, char moves_array[]) {
   if (!even(action)) {
@@ -428,15 +660,17 @@ check_error(char moves_array[], board_t board, int action) {
   tgt_col = tgt_letter-ASCII_A;
   tgt_row = tgt_num-1;
 
-  src_content = board[src_row][src_col];
-  tgt_content = board[tgt_row][tgt_col];
-
   /* ERRORS */
   if (src_col<0 || src_row<0 || src_col>=BOARD_SIZE|| src_row>=BOARD_SIZE) 
     return 1;
   else if (tgt_col<0 || tgt_row<0 || tgt_col>=BOARD_SIZE || tgt_row>=BOARD_SIZE) 
     return 2;
-  else if (src_content == CELL_EMPTY) 
+
+  /* only look at the cells once they are known to be on the board */
+  src_content = board[src_row][src_col];
+  tgt_content = board[tgt_row][tgt_col];
+
+  if (src_content == CELL_EMPTY) 
     return 3;
   else if (tgt_content != CELL_EMPTY) 
     return 4;
@@ -574,7 +808,7 @@ char legal_move[BOARD_SIZE * BOARD_SIZE][MAX_LEN]) {
         src_num = row + 1;
         src_let = col + ASCII_A;
 
-        for (i=0; i<=DIRECTION; i++) {
+        for (i=0; i<DIRECTION; i++) {
           tgt_num = row + row_moves[i] + 1;
           tgt_let = col + col_moves[i] + ASCII_A;
 
@@ -603,69 +837,325 @@ char legal_move[BOARD_SIZE * BOARD_SIZE][MAX_LEN]) {
     Author: Sebastian Lague 
     Access Date: October 2021
     Availability: https://pastebin.com/VSehqDM3
-for Foundation of Algorithm, Semester 2 2021, Assigment 2. */
+for Foundation of Algorithm, Semester 2 2021, Assigment 2. 
+
+   The recursion is unrolled onto an explicit stack of frames, so a search can
+   stop after any number of nodes and carry on later from the same place. 
+   Branches that cannot change the result are pruned with alpha-beta, and 
+   below the root the moves are tried killer moves first, then by history. */
 int 
-minimax(board_t position, int depth, int maxi_player, char best[MAX_LEN]) {
-  int eval, max_eval, min_eval, move_count, i;
+minimax(board_t position, int depth, int maxi_player, char best[MAX_LEN],
+struct SearchStats* stats) {
+  /* run a whole search in one go and return its minimax value */
+
+  struct Search search;
 
-  /* base case; if depth is 0 and game ends (value 1->black or 2->white) */
-  if (depth == 0 || game_end(position) > 0) { 
-    return board_cost(position);
+  search_init(&search, position, depth, maxi_player);
+  while (search_step(&search, SEARCH_QUANTUM) == SEARCH_RUNNING);
+
+  strcpy(best, search.best);
+  if (stats != NULL) {
+    *stats = search.stats;
   }
+  return search.result;
+}
 
-  if (!even(maxi_player)) { // black's action
-    max_eval = INT_MIN;
-    char best_move[MAX_LEN];
+void
+search_init(struct Search* search, board_t position, int depth, 
+int maxi_player) {
+  /* set up a search with only the root frame on the stack */
+
+  assert(depth >= 0 && depth <= TREE_DEPTH);
+
+  search->top = 0;
+  search->status = SEARCH_RUNNING;
+  search->cancelled = 0;
+  search->deadline = 0;
+  search->result = 0;
+  search->best[0] = 0;
+  memset(&search->stats, 0, sizeof(search->stats));
+  memset(search->killers, -1, sizeof(search->killers));
+  memset(search->history, 0, sizeof(search->history));
+
+  memcpy(search->stack[0].position, position, 
+    sizeof(char) * BOARD_SIZE * BOARD_SIZE);
+  search->stack[0].depth = depth;
+  search->stack[0].black = !even(maxi_player);
+  search->stack[0].move_count = -1;
+  search->stack[0].best_move[0] = 0;
+  search->stack[0].alpha = INT_MIN;
+  search->stack[0].beta = INT_MAX;
+}
 
-    /* try for each legal move in the current position of the board */
-    char legal_moves[BOARD_SIZE * BOARD_SIZE][MAX_LEN];
-    move_count = find_move(position, 1, legal_moves); // (1) odd, find black
-    
-    for (i = 0; i < move_count; i++) {
-      board_t new_position; // create a temporal position
-      memcpy(new_position, position, sizeof(char) * BOARD_SIZE * BOARD_SIZE);
-      update_board(legal_moves[i], new_position, 1);
-      
-      eval = minimax(new_position, depth-1, 0, best); // recursion
-
-      if (eval > max_eval) {
-        max_eval = eval;
-        strcpy(best_move, legal_moves[i]); // update as best move
+void
+search_set_deadline(struct Search* search, double deadline_ms) {
+  /* stop the search once deadline_ms of wall time have passed from now */
+
+  search->deadline = now_ns() + (long long)(deadline_ms * 1e6);
+}
+
+long long
+now_ns(void) {
+  /* monotonic wall-clock time in nanoseconds */
+
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+void
+search_cancel(struct Search* search) {
+  /* ask the search to stop at its next yield point */
+
+  search->cancelled = 1;
+}
+
+int
+search_step(struct Search* search, int node_budget) {
+  /* expand up to node_budget nodes, then yield; returns the search status */
+
+  struct Frame *frame, *child;
+
+  while (search->status == SEARCH_RUNNING) {
+    if (search->cancelled) {
+      search->status = SEARCH_CANCELLED;
+      break;
+    }
+    if (search->deadline && now_ns() > search->deadline) {
+      search_expire(search);
+      break;
+    }
+    if (node_budget-- <= 0) {
+      break; // yield, still running
+    }
+
+    frame = &search->stack[search->top];
+
+    /* first visit; if depth is 0 and game ends (value 1->black or 2->white) */
+    if (frame->move_count < 0) {
+      search->stats.nodes++;
+      if (frame->depth == 0 || game_end(frame->position) > 0) {
+        search_return(search, board_cost(frame->position));
+        continue;
+      }
+
+      /* (1) odd, find black; (0) even, find white */
+      frame->move_count = find_move(frame->position, frame->black, 
+        frame->legal_moves);
+      frame->next = 0;
+      frame->eval = frame->black ? INT_MIN : INT_MAX;
+      frame->best_move[0] = 0;
+
+      /* keep the root in board-scan order, so ties pick the same move */
+      if (search->top > 0) {
+        order_moves(search, frame, search->top);
       }
     }
 
-    if (depth == TREE_DEPTH) { 
-      strcpy(best, best_move);
+    /* try for each legal move in the current position of the board */
+    if (frame->next < frame->move_count) {
+      child = &search->stack[search->top+1];
+      memcpy(child->position, frame->position, 
+        sizeof(char) * BOARD_SIZE * BOARD_SIZE);
+      update_board(frame->legal_moves[frame->next], child->position, 
+        frame->black);
+      child->depth = frame->depth-1;
+      child->black = !frame->black;
+      child->move_count = -1;
+      child->alpha = frame->alpha;
+      child->beta = frame->beta;
+      search->top++; // "recursion"
+    } else {
+      search_return(search, frame->eval);
     }
+  }
+
+  return search->status;
+}
 
-    return max_eval;
+void
+search_expire(struct Search* search) {
+  /* out of time; settle for the best root move so far, or the first one */
+
+  struct Frame* root = &search->stack[0];
+
+  if (root->move_count < 0) { // root not expanded yet
+    root->move_count = find_move(root->position, root->black, 
+      root->legal_moves);
+    root->best_move[0] = 0;
+  }
+  if (root->best_move[0] == 0 && root->move_count > 0) {
+    strcpy(root->best_move, root->legal_moves[0]);
   }
-  else { // white's action
-    min_eval = INT_MAX;
-    char best_move[MAX_LEN];
 
-    char legal_moves[BOARD_SIZE * BOARD_SIZE][MAX_LEN];
-    move_count = find_move(position, 0, legal_moves); // (0) even, find black
-    
-    for (i = 0; i < move_count; i++) {
-      board_t new_position;
-      memcpy(new_position, position, sizeof(char) * BOARD_SIZE * BOARD_SIZE);
-      update_board(legal_moves[i], new_position, 0);
-      
-      eval = minimax(new_position, depth-1, 1, best);   
+  strcpy(search->best, root->best_move);
+  search->status = SEARCH_EXPIRED;
+}
+
+void
+search_return(struct Search* search, int eval) {
+  /* pop the top frame and hand its value to the parent */
 
-      if (eval < min_eval) {
-        min_eval = eval;
-        strcpy(best_move, legal_moves[i]);
+  struct Frame* parent;
+  int key, ply;
+
+  if (search->top == 0) {
+    search->result = eval;
+    strcpy(search->best, search->stack[0].best_move);
+    search->status = SEARCH_DONE;
+    return;
+  }
+
+  search->top--;
+  parent = &search->stack[search->top];
+
+  /* the first move is recorded even if it loses, so there is always one */
+  if (parent->best_move[0] == 0 || (parent->black && eval > parent->eval) || 
+    (!parent->black && eval < parent->eval)) {
+    parent->eval = eval;
+    strcpy(parent->best_move, parent->legal_moves[parent->next]);
+  }
+
+  if (parent->black && parent->eval > parent->alpha) {
+    parent->alpha = parent->eval;
+  } else if (!parent->black && parent->eval < parent->beta) {
+    parent->beta = parent->eval;
+  }
+
+  /* cutoff; the opponent will never let the game reach this position */
+  if (parent->alpha >= parent->beta) {
+    ply = search->top;
+    key = move_key(parent->legal_moves[parent->next]);
+
+    search->stats.cutoffs++;
+    if (parent->next == 0) {
+      search->stats.first_cutoffs++;
+    }
+    if (search->killers[ply][0] != key) {
+      search->killers[ply][1] = search->killers[ply][0];
+      search->killers[ply][0] = key;
+    }
+    search->history[key / (BOARD_SIZE * BOARD_SIZE)]
+      [key % (BOARD_SIZE * BOARD_SIZE)] += parent->depth * parent->depth;
+
+    parent->next = parent->move_count; // skip the remaining moves
+    return;
+  }
+  parent->next++;
+}
+
+int
+move_key(const char move[]) {
+  /* number a move by its source and target cells, from*64+to */
+
+  int src = (move[1]-ASCII_0-1) * BOARD_SIZE + (move[0]-ASCII_A);
+  int tgt = (move[4]-ASCII_0-1) * BOARD_SIZE + (move[3]-ASCII_A);
+
+  return src * BOARD_SIZE * BOARD_SIZE + tgt;
+}
+
+void
+order_moves(struct Search* search, struct Frame* frame, int ply) {
+  /* sort the frame's moves, killer moves first, then by history score */
+
+  int score[BOARD_SIZE * BOARD_SIZE];
+  char move[MAX_LEN];
+  int i, j, key, move_score;
+
+  for (i = 0; i < frame->move_count; i++) {
+    key = move_key(frame->legal_moves[i]);
+    if (key == search->killers[ply][0]) {
+      score[i] = KILLER_SCORE;
+    } else if (key == search->killers[ply][1]) {
+      score[i] = KILLER_SCORE - 1;
+    } else {
+      score[i] = search->history[key / (BOARD_SIZE * BOARD_SIZE)]
+        [key % (BOARD_SIZE * BOARD_SIZE)];
+    }
+  }
+
+  /* insertion sort, stable so equal scores keep board-scan order */
+  for (i = 1; i < frame->move_count; i++) {
+    move_score = score[i];
+    strcpy(move, frame->legal_moves[i]);
+    for (j = i; j > 0 && score[j-1] < move_score; j--) {
+      score[j] = score[j-1];
+      strcpy(frame->legal_moves[j], frame->legal_moves[j-1]);
+    }
+    score[j] = move_score;
+    strcpy(frame->legal_moves[j], move);
+  }
+}
+
+int
+run_searches(struct Search searches[], int count, int node_budget, 
+int threads) {
+  /* run many searches on up to threads workers, each interleaving its share
+     node_budget nodes per turn, until all have stopped; returns the number 
+     that ran to completion */
+
+  struct Worker* workers;
+  int i, done = 0;
+
+  if (threads > count) {
+    threads = count;
+  }
+  workers = threads > 1 ? 
+    (struct Worker*)malloc(threads * sizeof(struct Worker)) : NULL;
+
+  if (workers == NULL) {
+    while (search_round(searches, count, node_budget));
+  } else {
+    for (i = 0; i < threads; i++) {
+      workers[i].searches = searches + (long)count * i / threads;
+      workers[i].count = (long)count * (i+1) / threads - 
+        (long)count * i / threads;
+      workers[i].node_budget = node_budget;
+      workers[i].started = pthread_create(&workers[i].thread, NULL, 
+        search_worker, &workers[i]) == 0;
+      if (!workers[i].started) {
+        search_worker(&workers[i]); // no thread, run the share here
       }
     }
-    
-    if (depth == TREE_DEPTH) {
-      strcpy(best, best_move);
+    for (i = 0; i < threads; i++) {
+      if (workers[i].started) {
+        pthread_join(workers[i].thread, NULL);
+      }
+    }
+    free(workers);
+  }
+
+  for (i = 0; i < count; i++) {
+    if (searches[i].status == SEARCH_DONE) {
+      done++;
     }
+  }
+  return done;
+}
+
+void*
+search_worker(void* arg) {
+  /* one worker of run_searches; searches share no state, so no locking */
 
-    return min_eval;
+  struct Worker* worker = arg;
+
+  while (search_round(worker->searches, worker->count, worker->node_budget));
+  return NULL;
+}
+
+int
+search_round(struct Search searches[], int count, int node_budget) {
+  /* give each search one turn; returns 1 if any is still running */
+
+  int i, running = 0;
+
+  for (i = 0; i < count; i++) {
+    if (search_step(&searches[i], node_budget) == SEARCH_RUNNING) {
+      running = 1;
+    }
   }
+  return running;
 }
 
 int 
@@ -706,6 +1196,893 @@ game_end(board_t board) {
 }
 /*----------------------------------------------------------------------------*/
 
+/*------------------------------ SESSION MODE --------------------------------*/
+/* With -p the moves are played as they arrive rather than after the whole
+   input is read. While the opponent thinks, the engine searches its answer to
+   every reply it could make, and keeps only the one that matches. */
+void
+session_moves(board_t board, int show_stats) {
+  /* play input strings one by one, pondering between them */
+
+  char token[MAX_LEN];
+  int action = 1, got;
+  struct Input input = {{0}, 0, 0};
+  struct Ponder* ponder = (struct Ponder*)malloc(sizeof(struct Ponder));
+
+  if (ponder == NULL) {
+    printf("FAIL IN MEMORY ALLOCATION!");
+    exit(EXIT_FAILURE);
+  }
+  ponder->count = 0;
+
+  board_details(board);
+  print_board(board);
+  fflush(stdout);
+
+  while ((got = next_token(&input, ponder, token)) != 0) {
+    if (got < 0) { // longer than any move
+      print_error(6);
+      exit(EXIT_FAILURE);
+    }
+
+    if (strlen(token) == 5) {
+      ponder_reply(ponder, token);
+    } else if (*token != 'A' && *token != 'P') {
+      ponder_stop(ponder);
+    }
+
+    play_action(board, token, &action, show_stats, ponder);
+    fflush(stdout);
+
+    if (strlen(token) != 5 && (*token == 'A' || *token == 'P')) {
+      ponder_start(ponder, board, action);
+    }
+  }
+
+  free(ponder);
+}
+
+int
+next_token(struct Input* input, struct Ponder* ponder, char token[]) {
+  /* wait for the next input string, pondering until it is typed in; 
+     returns 1 for a string, 0 at the end, -1 for a string too long to be 
+     a move */
+
+  struct pollfd stdin_poll = {STDIN_FILENO, POLLIN, 0};
+  int start, end, got;
+
+  while (1) {
+    /* a complete string is in the buffer */
+    for (start = 0; start < input->len && 
+      isspace((unsigned char)input->buf[start]); start++);
+    for (end = start; end < input->len && 
+      !isspace((unsigned char)input->buf[end]); end++);
+    if (end > start && (end < input->len || input->eof)) {
+      if (end-start > MAX_LEN-1) {
+        return -1;
+      }
+      memcpy(token, input->buf + start, end-start);
+      token[end-start] = 0;
+      input->len -= end;
+      memmove(input->buf, input->buf + end, input->len);
+      return 1;
+    }
+    if (input->eof) {
+      return 0;
+    }
+
+    /* make room by dropping the spaces */
+    input->len -= start;
+    memmove(input->buf, input->buf + start, input->len);
+    if (input->len > MAX_LEN-1) {
+      return -1;
+    }
+
+    /* nothing typed yet, think about the replies a bit more */
+    if (search_round(ponder->searches, ponder->count, SEARCH_QUANTUM) && 
+      poll(&stdin_poll, 1, 0) == 0) {
+      continue;
+    }
+
+    got = read(STDIN_FILENO, input->buf + input->len, 
+      INPUT_BUF_SIZE - input->len);
+    if (got <= 0) {
+      input->eof = 1;
+    } else {
+      input->len += got;
+    }
+  }
+}
+
+void
+ponder_start(struct Ponder* ponder, board_t board, int action) {
+  /* search the engine's answer to each reply the opponent could make */
+
+  board_t position;
+  int i;
+
+  ponder->count = 0;
+  if (game_end(board) > 0) {
+    return;
+  }
+
+  ponder->count = find_move(board, action, ponder->replies);
+  ponder->action = action+1;
+  ponder->chosen = -1;
+  for (i = 0; i < ponder->count; i++) {
+    memcpy(position, board, sizeof(char) * BOARD_SIZE * BOARD_SIZE);
+    update_board(ponder->replies[i], position, action);
+    search_init(&ponder->searches[i], position, TREE_DEPTH, action+1);
+  }
+}
+
+void
+ponder_reply(struct Ponder* ponder, const char move[]) {
+  /* the opponent moved; keep the search for that reply, drop the rest */
+
+  int i;
+
+  if (ponder->count == 0 || ponder->chosen >= 0) {
+    ponder_stop(ponder);
+    return;
+  }
+
+  for (i = 0; i < ponder->count; i++) {
+    if (strcmp(ponder->replies[i], move) == 0) {
+      ponder->chosen = i;
+    } else {
+      search_cancel(&ponder->searches[i]);
+    }
+  }
+  if (ponder->chosen < 0) {
+    ponder->count = 0;
+  }
+}
+
+struct Search*
+ponder_take(struct Ponder* ponder, board_t board, int action) {
+  /* hand over the kept search if it is for this position, else NULL */
+
+  struct Search* search;
+
+  if (ponder == NULL || ponder->count == 0 || ponder->chosen < 0) {
+    return NULL;
+  }
+
+  search = &ponder->searches[ponder->chosen];
+  ponder->count = 0;
+  if (ponder->action != action || memcmp(search->stack[0].position, board, 
+    sizeof(char) * BOARD_SIZE * BOARD_SIZE) != 0) {
+    return NULL;
+  }
+  ponder->ahead = search->stats.nodes;
+  return search;
+}
+
+void
+ponder_stop(struct Ponder* ponder) {
+  /* forget every pondered search */
+
+  int i;
+
+  for (i = 0; i < ponder->count; i++) {
+    search_cancel(&ponder->searches[i]);
+  }
+  ponder->count = 0;
+}
+/*----------------------------------------------------------------------------*/
+
+/*----------------------------- MULTI-GAME MODE ------------------------------*/
+/* With -multi MS THREADS GAME... each GAME is an input file, and all of them
+   are played at once. Each round the engine searches every game that still
+   has an A or P to play, split over THREADS workers that each take their
+   searches a quantum of nodes at a time in turn. A search still running MS
+   milliseconds (wall time) after the round started plays the best move it
+   has found so far; 0 means no deadline. */
+void
+multi_games(double deadline_ms, int threads, int game_count, char* files[]) {
+  /* play the engine moves of many games, interleaving their searches */
+
+  struct Game* games = (struct Game*)malloc(game_count * sizeof(struct Game));
+  struct Search* searches = 
+    (struct Search*)malloc(game_count * sizeof(struct Search));
+  int* playing = (int*)malloc(game_count * sizeof(int)); // game of a search
+  int i, count;
+
+  if (games == NULL || searches == NULL || playing == NULL) {
+    printf("FAIL IN MEMORY ALLOCATION!");
+    exit(EXIT_FAILURE);
+  }
+
+  for (i = 0; i < game_count; i++) {
+    load_game(&games[i], files[i]);
+  }
+
+  while (1) {
+    count = 0;
+    for (i = 0; i < game_count; i++) {
+      if (games[i].pending > 0) {
+        search_init(&searches[count], games[i].board, TREE_DEPTH, 
+          games[i].action);
+        if (deadline_ms > 0) {
+          search_set_deadline(&searches[count], deadline_ms);
+        }
+        playing[count++] = i;
+      }
+    }
+    if (count == 0) {
+      break;
+    }
+
+    run_searches(searches, count, SEARCH_QUANTUM, threads);
+    for (i = 0; i < count; i++) {
+      game_move(&games[playing[i]], &searches[i]);
+    }
+  }
+
+  free(games);
+  free(searches);
+  free(playing);
+}
+
+void
+load_game(struct Game* game, const char* name) {
+  /* play the input moves of a game file, up to its A or P */
+
+  char token[MAX_TOKEN];
+  int error, status;
+  FILE* in = fopen(name, "r");
+
+  game->name = name;
+  game->action = 1;
+  game->pending = 0;
+  initialise_board(game->board);
+
+  if (in == NULL) {
+    printf("%s: ERROR: Cannot open game.\n", name);
+    return;
+  }
+
+  while (fscanf(in, "%31s", token) == 1) {
+    if (strlen(token) == 5) {
+      error = check_error(token, game->board, game->action);
+      if (error != 0) {
+        printf("%s: ", name);
+        print_error(error);
+        break;
+      }
+      update_board(token, game->board, game->action);
+      game->action++;
+    } else if (*token == 'A' || *token == 'P') {
+      game->pending = *token == 'A' ? 1 : COMP_ACTIONS;
+      break;
+    }
+  }
+  fclose(in);
+
+  status = game_end(game->board);
+  if (status > 0) {
+    printf("%s: %s WIN!\n", name, status == 1 ? "BLACK" : "WHITE");
+    game->pending = 0;
+  }
+}
+
+void
+game_move(struct Game* game, struct Search* search) {
+  /* play the move the game's search found */
+
+  int status;
+
+  if (search->best[0] == 0) { // only when the side to move cannot move
+    printf("%s: NO LEGAL MOVE\n", game->name);
+    game->pending = 0;
+    return;
+  }
+
+  update_board(search->best, game->board, game->action);
+  printf("%s: ", game->name);
+  new_action_marker();
+  action_detail(game->action, search->best);
+  if (search->status == SEARCH_EXPIRED) {
+    printf("%s: DEADLINE PASSED, BEST MOVE SO FAR PLAYED\n", game->name);
+  }
+  game->action++;
+  game->pending--;
+
+  status = game_end(game->board);
+  if (status > 0) {
+    printf("%s: %s WIN!\n", game->name, status == 1 ? "BLACK" : "WHITE");
+    game->pending = 0;
+  }
+}
+/*----------------------------------------------------------------------------*/
+
+/*------------------------------ GAME DATABASE -------------------------------*/
+/* A database is two files in the host's byte order. DB holds a DbHeader, then
+   each game as a GameHeader followed by one byte per move: the source cell
+   among the 32 dark cells, the diagonal direction and whether it jumps.
+   DB.idx holds an IndexHeader, an IndexEntry for every (board hash, game 
+   offset) pair, sorted, and a directory of where each hash bucket starts.
+   The import sorts INDEX_CHUNK entries at a time into a temporary spill 
+   file, then merges the sorted runs, so it needs a fixed amount of memory
+   however many games there are. */
+void
+import_games(const char* db_name, int file_count, char* files[]) {
+  /* stream games from logs (or stdin) into DB, then index their positions */
+
+  struct DbHeader header = {DB_MAGIC, DB_VERSION, 0};
+  struct GameRecord* game;
+  uint64_t positions = 0;
+  FILE *db, *in;
+  int i;
+
+  game = (struct GameRecord*)malloc(sizeof(struct GameRecord));
+  db = fopen(db_name, "wb");
+  if (game == NULL || db == NULL) {
+    printf("ERROR: Cannot create game database %s.\n", db_name);
+    exit(EXIT_FAILURE);
+  }
+  fwrite(&header, sizeof(header), 1, db);
+
+  initialise_board(game->board);
+  game->action = 1;
+  game->move_count = 0;
+  game->flags = 0;
+
+  if (file_count == 0) {
+    read_log(stdin, db, game, &header, &positions);
+  }
+  for (i = 0; i < file_count; i++) {
+    in = fopen(files[i], "r");
+    if (in == NULL) {
+      printf("ERROR: Cannot open game log %s.\n", files[i]);
+      exit(EXIT_FAILURE);
+    }
+    read_log(in, db, game, &header, &positions);
+    fclose(in);
+  }
+
+  /* now that the count is known, fill in the header */
+  fseek(db, 0, SEEK_SET);
+  fwrite(&header, sizeof(header), 1, db);
+  if (fclose(db) != 0) {
+    printf("ERROR: Cannot write game database %s.\n", db_name);
+    exit(EXIT_FAILURE);
+  }
+  free(game);
+
+  build_index(db_name, positions);
+  printf("#GAMES IMPORTED: %llu\n", (unsigned long long)header.game_count);
+}
+
+void
+read_log(FILE* in, FILE* db, struct GameRecord* game, 
+struct DbHeader* header, uint64_t* positions) {
+  /* pick the moves out of a game log or an input file */
+
+  char token[MAX_TOKEN];
+
+  while (fscanf(in, "%31s", token) == 1) {
+    if (strcmp(token, "SIZE:") == 0) { // "BOARD SIZE:" starts a new game
+      write_game(db, game, header, positions);
+    } else if (is_move(token)) {
+      record_move(game, token);
+    }
+  }
+  write_game(db, game, header, positions); // a file holds whole games
+}
+
+void
+record_move(struct GameRecord* game, const char move[]) {
+  /* replay the move and add it to the game, unless the game went wrong */
+
+  if (game->flags & DB_TRUNCATED) {
+    return;
+  }
+  if (game->move_count == DB_MAX_MOVES || 
+    check_error((char*)move, game->board, game->action) != 0) {
+    game->flags |= DB_TRUNCATED; // keep the moves up to here
+    return;
+  }
+
+  game->moves[game->move_count++] = encode_move(move);
+  update_board((char*)move, game->board, game->action);
+  game->action++;
+}
+
+void
+write_game(FILE* db, struct GameRecord* game, struct DbHeader* header, 
+uint64_t* positions) {
+  /* append the game to the database and start a new one */
+
+  struct GameHeader game_header;
+
+  if (game->move_count > 0) {
+    game_header.game_id = header->game_count;
+    game_header.move_count = game->move_count;
+    game_header.result = game_end(game->board);
+    game_header.flags = game->flags;
+
+    fwrite(&game_header, sizeof(game_header), 1, db);
+    fwrite(game->moves, 1, game->move_count, db);
+    header->game_count++;
+    *positions += game->move_count + 1; // including the starting board
+  }
+
+  initialise_board(game->board);
+  game->action = 1;
+  game->move_count = 0;
+  game->flags = 0;
+}
+
+int
+compare_entries(const void* a, const void* b) {
+  /* order index entries by hash, then by game offset */
+
+  const struct IndexEntry* x = a;
+  const struct IndexEntry* y = b;
+
+  if (x->hash != y->hash) {
+    return x->hash < y->hash ? -1 : 1;
+  }
+  if (x->offset != y->offset) {
+    return x->offset < y->offset ? -1 : 1;
+  }
+  return 0;
+}
+
+void
+build_index(const char* db_name, uint64_t positions) {
+  /* write DB.idx from the boards of every game in DB */
+
+  char idx_name[FILENAME_MAX];
+  struct IndexHeader header = {IDX_MAGIC, DB_VERSION, 0, 0, 4, 0};
+  struct GameHeader game_header;
+  struct IndexEntry* chunk;
+  struct Run* runs = NULL;
+  uint64_t offset;
+  unsigned char* db;
+  char move[MAX_LEN];
+  size_t db_size;
+  int count = 0, run_count = 0, i;
+  FILE *spill, *out;
+  board_t board;
+
+  /* about 8 entries per bucket */
+  while (header.bucket_bits < 24 && 
+    ((uint64_t)8 << header.bucket_bits) < positions) {
+    header.bucket_bits++;
+  }
+
+  snprintf(idx_name, sizeof(idx_name), "%s.idx", db_name);
+  db = map_file(db_name, &db_size);
+  header.db_size = db_size;
+  chunk = (struct IndexEntry*)malloc(INDEX_CHUNK * sizeof(struct IndexEntry));
+  spill = tmpfile();
+  out = fopen(idx_name, "wb");
+  if (chunk == NULL || spill == NULL || out == NULL) {
+    printf("ERROR: Cannot create position index %s.\n", idx_name);
+    exit(EXIT_FAILURE);
+  }
+
+  /* every board of every game, sorted a chunk at a time */
+  offset = sizeof(struct DbHeader);
+  while (offset + sizeof(game_header) <= db_size) {
+    memcpy(&game_header, db + offset, sizeof(game_header));
+    initialise_board(board);
+    for (i = 0; i <= game_header.move_count; i++) {
+      if (i > 0) {
+        decode_move(db[offset + sizeof(game_header) + i-1], move);
+        update_board(move, board, i);
+      }
+      chunk[count].hash = board_hash(board);
+      chunk[count++].offset = offset;
+      if (count == INDEX_CHUNK) {
+        runs = spill_run(spill, chunk, count, runs, &run_count);
+        count = 0;
+      }
+    }
+    offset += sizeof(game_header) + game_header.move_count;
+  }
+  runs = spill_run(spill, chunk, count, runs, &run_count);
+  free(chunk);
+  munmap(db, db_size);
+
+  fwrite(&header, sizeof(header), 1, out); // entry count comes later
+  if (!merge_runs(spill, runs, run_count, out, header.bucket_bits, 
+    &header.entry_count)) {
+    printf("ERROR: Cannot write position index %s.\n", idx_name);
+    exit(EXIT_FAILURE);
+  }
+
+  fseek(out, 0, SEEK_SET);
+  fwrite(&header, sizeof(header), 1, out);
+  if (fclose(out) != 0) {
+    printf("ERROR: Cannot write position index %s.\n", idx_name);
+    exit(EXIT_FAILURE);
+  }
+  fclose(spill);
+  free(runs);
+}
+
+struct Run*
+spill_run(FILE* spill, struct IndexEntry chunk[], int count, 
+struct Run runs[], int* run_count) {
+  /* sort the chunk and append it to the spill file as a new run */
+
+  struct Run* run;
+
+  if (count == 0) {
+    return runs;
+  }
+  runs = (struct Run*)realloc(runs, (*run_count+1) * sizeof(struct Run));
+  if (runs == NULL) {
+    printf("FAIL IN MEMORY ALLOCATION!");
+    exit(EXIT_FAILURE);
+  }
+
+  qsort(chunk, count, sizeof(struct IndexEntry), compare_entries);
+  run = &runs[(*run_count)++];
+  run->next = ftell(spill) / sizeof(struct IndexEntry);
+  run->end = run->next + count;
+  fwrite(chunk, sizeof(struct IndexEntry), count, spill);
+  return runs;
+}
+
+int
+merge_runs(FILE* spill, struct Run runs[], int run_count, FILE* out, 
+int bits, uint64_t* kept) {
+  /* merge the sorted runs into out, dropping boards a game reaches more 
+     than once, then write the bucket directory; 1 if all went well */
+
+  int size = run_count > 0 ? INDEX_CHUNK / run_count : 0;
+  int *heap, heap_count = 0, i, got;
+  struct IndexEntry *buf, entry, last = {0, 0};
+  uint64_t bucket, next_bucket = 0, start[DIRECTORY_COPY];
+  FILE* directory = tmpfile();
+
+  if (size == 0) {
+    size = 1;
+  }
+  buf = (struct IndexEntry*)malloc(
+    ((size_t)run_count * size + 1) * sizeof(struct IndexEntry));
+  heap = (int*)malloc((run_count + 1) * sizeof(int));
+  if (buf == NULL || heap == NULL || directory == NULL) {
+    return 0;
+  }
+
+  /* a heap of the runs, smallest next entry on top */
+  for (i = 0; i < run_count; i++) {
+    runs[i].buf = buf + (size_t)i * size;
+    refill_run(spill, &runs[i], size);
+    heap[heap_count++] = i;
+  }
+  for (i = heap_count/2 - 1; i >= 0; i--) {
+    heap_down(heap, heap_count, runs, i);
+  }
+
+  *kept = 0;
+  while (heap_count > 0) {
+    struct Run* run = &runs[heap[0]];
+    entry = run->buf[run->pos++];
+    if (run->pos == run->len) {
+      refill_run(spill, run, size);
+      if (run->len == 0) {
+        heap[0] = heap[--heap_count];
+      }
+    }
+    heap_down(heap, heap_count, runs, 0);
+
+    if (*kept > 0 && compare_entries(&last, &entry) == 0) {
+      continue;
+    }
+
+    /* bucket b starts at the first entry whose top bits are at least b */
+    bucket = entry.hash >> (64 - bits);
+    while (next_bucket <= bucket) {
+      fwrite(kept, sizeof(uint64_t), 1, directory);
+      next_bucket++;
+    }
+    fwrite(&entry, sizeof(entry), 1, out);
+    last = entry;
+    (*kept)++;
+  }
+  while (next_bucket <= ((uint64_t)1 << bits)) {
+    fwrite(kept, sizeof(uint64_t), 1, directory);
+    next_bucket++;
+  }
+
+  /* the directory follows the entries */
+  rewind(directory);
+  while ((got = fread(start, sizeof(uint64_t), DIRECTORY_COPY, 
+    directory)) > 0) {
+    fwrite(start, sizeof(uint64_t), got, out);
+  }
+
+  fclose(directory);
+  free(heap);
+  free(buf);
+  return !ferror(out) && !ferror(spill);
+}
+
+void
+refill_run(FILE* spill, struct Run* run, int size) {
+  /* read the next entries of the run, len is 0 once it is used up */
+
+  run->len = run->end - run->next < (uint64_t)size ? 
+    run->end - run->next : (uint64_t)size;
+  run->pos = 0;
+  if (run->len > 0) {
+    fseek(spill, run->next * sizeof(struct IndexEntry), SEEK_SET);
+    run->len = fread(run->buf, sizeof(struct IndexEntry), run->len, spill);
+    run->next += run->len;
+  }
+}
+
+void
+heap_down(int heap[], int count, struct Run runs[], int i) {
+  /* sift heap[i] down until no child holds a smaller entry */
+
+  int child, smallest, top;
+
+  while (1) {
+    smallest = i;
+    for (child = 2*i + 1; child <= 2*i + 2 && child < count; child++) {
+      if (compare_entries(&runs[heap[child]].buf[runs[heap[child]].pos], 
+        &runs[heap[smallest]].buf[runs[heap[smallest]].pos]) < 0) {
+        smallest = child;
+      }
+    }
+    if (smallest == i) {
+      return;
+    }
+    top = heap[i];
+    heap[i] = heap[smallest];
+    heap[smallest] = top;
+    i = smallest;
+  }
+}
+
+void
+query_games(const char* db_name) {
+  /* list every game in DB that reaches the board given on stdin */
+
+  char idx_name[FILENAME_MAX];
+  struct DbHeader db_header;
+  struct IndexHeader header;
+  struct IndexEntry* entries;
+  struct GameHeader game_header;
+  uint64_t *bucket_start, hash, bucket, offset, i;
+  unsigned char* db;
+  char* idx;
+  size_t db_size, idx_size;
+  int found = 0, action;
+  board_t board;
+
+  if (!read_board(stdin, board)) {
+    printf("ERROR: Board to search for is incomplete.\n");
+    exit(EXIT_FAILURE);
+  }
+
+  snprintf(idx_name, sizeof(idx_name), "%s.idx", db_name);
+  db = map_file(db_name, &db_size);
+  idx = map_file(idx_name, &idx_size);
+
+  if (db_size < sizeof(db_header)) {
+    printf("ERROR: %s is not a game database.\n", db_name);
+    exit(EXIT_FAILURE);
+  }
+  memcpy(&db_header, db, sizeof(db_header));
+  if (db_header.magic != DB_MAGIC || db_header.version != DB_VERSION) {
+    printf("ERROR: %s is not a game database.\n", db_name);
+    exit(EXIT_FAILURE);
+  }
+
+  if (idx_size < sizeof(header)) {
+    printf("ERROR: %s is not a position index.\n", idx_name);
+    exit(EXIT_FAILURE);
+  }
+  memcpy(&header, idx, sizeof(header));
+  if (header.magic != IDX_MAGIC || header.version != DB_VERSION || 
+    header.bucket_bits < 1 || header.bucket_bits > 32 || 
+    header.entry_count > idx_size / sizeof(struct IndexEntry) || 
+    idx_size != sizeof(header) + 
+      header.entry_count * sizeof(struct IndexEntry) + 
+      (((uint64_t)1 << header.bucket_bits) + 1) * sizeof(uint64_t)) {
+    printf("ERROR: %s is not a position index.\n", idx_name);
+    exit(EXIT_FAILURE);
+  }
+  if (header.db_size != db_size) {
+    printf("ERROR: %s was not built from %s.\n", idx_name, db_name);
+    exit(EXIT_FAILURE);
+  }
+
+  entries = (struct IndexEntry*)(idx + sizeof(header));
+  bucket_start = (uint64_t*)(entries + header.entry_count);
+
+  hash = board_hash(board);
+  bucket = hash >> (64 - header.bucket_bits);
+  if (bucket_start[bucket] > bucket_start[bucket+1] || 
+    bucket_start[bucket+1] > header.entry_count) {
+    printf("ERROR: %s is corrupt.\n", idx_name);
+    exit(EXIT_FAILURE);
+  }
+
+  for (i = bucket_start[bucket]; i < bucket_start[bucket+1]; i++) {
+    if (entries[i].hash != hash) {
+      continue;
+    }
+
+    /* the whole game must lie inside DB */
+    offset = entries[i].offset;
+    if (offset < sizeof(db_header) || 
+      offset > db_size - sizeof(game_header)) {
+      printf("ERROR: %s is corrupt.\n", idx_name);
+      exit(EXIT_FAILURE);
+    }
+    memcpy(&game_header, db + offset, sizeof(game_header));
+    if (offset + sizeof(game_header) + game_header.move_count > db_size) {
+      printf("ERROR: %s is corrupt.\n", idx_name);
+      exit(EXIT_FAILURE);
+    }
+
+    /* replay the game to rule out a hash collision */
+    action = replay_until(db + offset, board);
+    if (action >= 0) {
+      printf("GAME #%u: AFTER ACTION #%d, ", game_header.game_id, action);
+      if (game_header.result == 1) {
+        printf("BLACK WIN");
+      } else if (game_header.result == 2) {
+        printf("WHITE WIN");
+      } else {
+        printf("UNFINISHED");
+      }
+      if (game_header.flags & DB_TRUNCATED) {
+        printf(", TRUNCATED"); // the log went on past an illegal move
+      }
+      new_line();
+      found++;
+    }
+  }
+  printf("#GAMES FOUND: %d\n", found);
+
+  munmap(idx, idx_size);
+  munmap(db, db_size);
+}
+
+int
+replay_until(const unsigned char* game, board_t target) {
+  /* return the first action after which the game shows target, or -1 */
+
+  struct GameHeader game_header;
+  char move[MAX_LEN];
+  board_t board;
+  int i;
+
+  memcpy(&game_header, game, sizeof(game_header));
+  initialise_board(board);
+  for (i = 0; i <= game_header.move_count; i++) {
+    if (memcmp(board, target, sizeof(board_t)) == 0) {
+      return i;
+    }
+    if (i < game_header.move_count) {
+      decode_move(game[sizeof(game_header) + i], move);
+      if (!is_move(move)) {
+        return -1; // a corrupt byte, would move off the board
+      }
+      update_board(move, board, i+1);
+    }
+  }
+  return -1;
+}
+
+int
+read_board(FILE* in, board_t board) {
+  /* read a board in print_board format; 1 if all rows were found */
+
+  char line[MAX_LINE];
+  int row, col, rows_read = 0;
+
+  while (rows_read < BOARD_SIZE && fgets(line, sizeof(line), in) != NULL) {
+    /* " 1 | . | w | ..." has the cell of column col at 5+4*col */
+    if (sscanf(line, "%d", &row) != 1 || row < 1 || row > BOARD_SIZE || 
+      strlen(line) < (size_t)(5 + 4 * (BOARD_SIZE-1) + 1)) {
+      continue;
+    }
+    for (col = 0; col < BOARD_SIZE; col++) {
+      board[row-1][col] = line[5 + 4*col];
+    }
+    rows_read++;
+  }
+  return rows_read == BOARD_SIZE;
+}
+
+void*
+map_file(const char* name, size_t* size) {
+  /* map a whole file read-only into memory */
+
+  struct stat info;
+  void* data;
+  int fd;
+
+  fd = open(name, O_RDONLY);
+  if (fd < 0 || fstat(fd, &info) != 0) {
+    printf("ERROR: Cannot open %s.\n", name);
+    exit(EXIT_FAILURE);
+  }
+  *size = info.st_size;
+  data = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (data == MAP_FAILED) {
+    printf("ERROR: Cannot map %s.\n", name);
+    exit(EXIT_FAILURE);
+  }
+  close(fd); // the mapping stays valid
+  return data;
+}
+
+uint64_t
+board_hash(board_t board) {
+  /* FNV-1a hash of the cells */
+
+  uint64_t hash = FNV_OFFSET;
+  int row, col;
+
+  for (row = 0; row < BOARD_SIZE; row++) {
+    for (col = 0; col < BOARD_SIZE; col++) {
+      hash = (hash ^ board[row][col]) * FNV_PRIME;
+    }
+  }
+  return hash;
+}
+
+int
+is_move(const char token[]) {
+  /* a move looks like A6-B5 */
+
+  return strlen(token) == 5 && 
+    token[0] >= ASCII_A && token[0] < ASCII_A + BOARD_SIZE && 
+    token[1] > ASCII_0 && token[1] <= ASCII_0 + BOARD_SIZE && 
+    token[2] == ASCII_DASH && 
+    token[3] >= ASCII_A && token[3] < ASCII_A + BOARD_SIZE && 
+    token[4] > ASCII_0 && token[4] <= ASCII_0 + BOARD_SIZE;
+}
+
+int
+encode_move(const char move[]) {
+  /* pack a legal move into one byte; cell<<3 | south<<2 | east<<1 | jump */
+
+  int src_col = move[0]-ASCII_A;
+  int src_row = move[1]-ASCII_0-1;
+  int tgt_col = move[3]-ASCII_A;
+  int tgt_row = move[4]-ASCII_0-1;
+
+  /* only dark cells hold pieces, 4 per row */
+  int cell = src_row * (BOARD_SIZE/2) + src_col/2;
+
+  return cell << 3 | (tgt_row > src_row) << 2 | (tgt_col > src_col) << 1 | 
+    (diff(src_row, tgt_row) == 2);
+}
+
+void
+decode_move(unsigned char code, char move[]) {
+  /* turn a byte from encode_move back into a move like A6-B5 */
+
+  int cell = code >> 3;
+  int step = (code & 1) ? 2 : 1;
+  int src_row = cell / (BOARD_SIZE/2);
+  int src_col = 2 * (cell % (BOARD_SIZE/2)) + even(src_row); // dark cell
+  int tgt_row = src_row + ((code & 4) ? step : -step);
+  int tgt_col = src_col + ((code & 2) ? step : -step);
+
+  move[0] = src_col + ASCII_A;
+  move[1] = src_row + 1 + ASCII_0;
+  move[2] = ASCII_DASH;
+  move[3] = tgt_col + ASCII_A;
+  move[4] = tgt_row + 1 + ASCII_0;
+  move[5] = 0;
+}
+/*----------------------------------------------------------------------------*/
+
 /*-------------------------- OTHER HELPER FUNCTION ---------------------------*/
 int 
 even(int num) {